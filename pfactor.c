@@ -21,38 +21,79 @@
 
 #include "primenum.h"
 
+/* Print number-theoretic functions for a segment of values */
+static int print_mult(const struct primenum_mult *mult, void *data);
+
 /* Display usage instructions */
 static void usage(FILE *stream, char *exe_path);
 
 
+int
+print_mult(const struct primenum_mult *mult, void *data)
+{
+    primenum_int i;
+
+    (void)data;
+    for (i = 0; i < mult->count; ++i)
+        printf("%"PRIMENUM_FMT": phi=%"PRIMENUM_FMT" mu=%d"
+               " d=%"PRIMENUM_FMT" sigma=%"PRIMENUM_FMT" omega=%u\n",
+               mult->first + i,
+               mult->totient[i],
+               mult->mobius[i],
+               mult->divisors[i],
+               mult->divisor_sum[i],
+               mult->omega[i]);
+    return PRIMENUM_OK;
+}
+
 void
 usage(FILE *stream, char *exe_path)
 {
     fprintf(stream,
             "Usage: %s [-h] [-e] [-l PATH] VALUE [VALUE ...]\n"
+            "       %s [-h] [-l PATH] [-f FROM] -t TO\n"
             "  -h       Display this help message and exit\n"
             "  -e       Display repeated factors using exponential notation\n"
-            "  -l PATH  Load known primes from the specified file\n",
-            exe_path);
+            "  -f FROM  Start the table at the specified value (default 1)\n"
+            "  -l PATH  Load known primes from the specified file\n"
+            "  -t TO    Instead of factoring, print a table of Euler's\n"
+            "           totient, the Moebius function, the number and sum\n"
+            "           of divisors, and the number of distinct prime\n"
+            "           factors for each value below the specified value\n",
+            exe_path, exe_path);
 }
 
 int
 main(int argc, char **argv)
 {
-    int arg, opt;
+    int arg, opt, status;
     struct primenum_list *list, *factors;
-    primenum_int value;
+    struct primenum_table *table;
+    struct primenum_ctx *ctx;
+    primenum_int value, from, to;
     struct primenum_entry *factor;
-    bool use_exponents;
+    bool use_exponents, use_range, use_from;
 
     list = primenum_list_new(true);
     use_exponents = false;
+    use_range = false;
+    use_from = false;
+    from = 1;
+    to = 0;
 
-    while ((opt = getopt(argc, argv, "hel:")) != -1) {
+    while ((opt = getopt(argc, argv, "hef:l:t:")) != -1) {
         switch (opt) {
             case 'e':
                 use_exponents = true;
                 break;
+            case 'f':
+                from = atol(optarg);
+                use_from = true;
+                break;
+            case 't':
+                to = atol(optarg);
+                use_range = true;
+                break;
             case 'l':
                 primenum_load_from_disk(list, optarg);
                 break;
@@ -65,23 +106,61 @@ main(int argc, char **argv)
         }
     }
 
+    if ((use_from) && (!use_range)) {
+        /* don't accept gratuitous or contradictory arguments */
+        usage(stderr, argv[0]);
+        return 1;
+    }
+
+    if (use_range) {
+        /* Values come from -f and -t, not the command line */
+        if ((optind < argc) || (use_exponents) || (from == 0)) {
+            usage(stderr, argv[0]);
+            return 1;
+        }
+
+        status = primenum_mult_range(list, from, to,
+                                     PRIMENUM_TOTIENT
+                                     | PRIMENUM_MOBIUS
+                                     | PRIMENUM_DIVISORS
+                                     | PRIMENUM_DIVISOR_SUM
+                                     | PRIMENUM_OMEGA,
+                                     print_mult, NULL);
+        if (status != PRIMENUM_OK)
+            fprintf(stderr, "Out of memory\n"); /* well, probably */
+        primenum_list_free(list);
+        return status;
+    }
+
     /* We need at least one command-line argument */
     if (optind >= argc) {
         usage(stderr, argv[0]);
         return 1;
     }
 
+    /* Factoring only needs primes up to each value's square root, which
+     * the context API finds without growing our list all the way */
+    table = primenum_table_new(list);
+    primenum_list_free(list);
+    ctx = (table == NULL) ? NULL : primenum_ctx_new(table);
+    if (ctx == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        if (table != NULL)
+            primenum_table_free(table);
+        return PRIMENUM_MEM_FULL;
+    }
+
     /* Factor values passed on the command line */
     for (arg = optind; arg < argc; ++arg) {
         value = atol(argv[arg]);
-        factors = primenum_factors(list, value, NULL, NULL);
+        factors = primenum_ctx_factors(ctx, value, NULL, NULL);
         if (factors == NULL) {
             fprintf(stderr, "Out of memory\n"); /* well, probably */
             break;
         }
 
         printf("%"PRIMENUM_FMT":", value);
-        if (use_exponents) {
+        if ((use_exponents) && (factors->head != NULL)) {
             primenum_int last_base;
             unsigned int exponent;
 
@@ -115,6 +194,7 @@ main(int argc, char **argv)
         primenum_list_free(factors);
     }
 
-    primenum_list_free(list);
+    primenum_ctx_free(ctx);
+    primenum_table_free(table);
     return 0;
 }
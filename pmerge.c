@@ -0,0 +1,290 @@
+/*
+ * A tool for merging shard files produced by primes -t.
+ * Copyright (c) 2022 Benjamin Johnson <bmjcode@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "primenum.h"
+
+/* Number of values copied at a time */
+#define COPY_SIZE 4096
+
+/* A shard file named on the command line */
+struct input {
+    const char *path;
+    struct primenum_shard shard;
+};
+
+/* Order inputs by the start of their range, for qsort() */
+static int compare_inputs(const void *a, const void *b);
+
+/* Create a temporary file to write the output to before renaming it */
+/* The path of the file is written to tmp_path, which must have room for
+ * strlen(out_path) + 32 characters. This returns NULL on failure. */
+static FILE *open_temp(const char *out_path, char *tmp_path);
+
+/* Copy the values in a shard to the output, checking them as we go */
+/* This returns one of the status codes enumerated in primenum.h. */
+static int copy_shard(const struct input *input, FILE *out);
+
+/* Display usage instructions */
+static void usage(FILE *stream, char *exe_path);
+
+
+int
+compare_inputs(const void *a, const void *b)
+{
+    const struct input *x = a, *y = b;
+
+    if (x->shard.from != y->shard.from)
+        return (x->shard.from < y->shard.from) ? -1 : 1;
+    /* Put empty shards first so they can't hide a gap */
+    if (x->shard.to != y->shard.to)
+        return (x->shard.to < y->shard.to) ? -1 : 1;
+    return 0;
+}
+
+FILE *
+open_temp(const char *out_path, char *tmp_path)
+{
+    int fd;
+    FILE *out;
+
+    /* Put it next to the output so rename() can't cross file systems,
+     * and use O_EXCL so we never clobber a file we didn't create */
+    sprintf(tmp_path, "%s.%ld.tmp", out_path, (long)getpid());
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd == -1)
+        return NULL;
+
+    out = fdopen(fd, "wb");
+    if (out == NULL) {
+        close(fd);
+        remove(tmp_path);
+    }
+    return out;
+}
+
+int
+copy_shard(const struct input *input, FILE *out)
+{
+    FILE *in;
+    primenum_int values[COPY_SIZE], last, count;
+    struct primenum_shard shard;
+    size_t i, n;
+    off_t start, end;
+    int status;
+
+    in = fopen(input->path, "rb");
+    if ((in == NULL)
+        || (primenum_shard_read_header(in, &shard) != PRIMENUM_OK)) {
+        if (in != NULL)
+            fclose(in);
+        return PRIMENUM_INVALID;
+    }
+
+    /* The data must be exactly the size the header says, or else the
+     * file was truncated or has junk on the end. fread() would quietly
+     * ignore a trailing partial value, so check this up front. */
+    start = ftello(in);
+    if ((start == -1)
+        || (fseeko(in, 0, SEEK_END) != 0)
+        || ((end = ftello(in)) == -1)
+        || ((primenum_int)(end - start)
+            != shard.count * sizeof(primenum_int))
+        || (fseeko(in, start, SEEK_SET) != 0)) {
+        fclose(in);
+        return PRIMENUM_INVALID;
+    }
+
+    status = PRIMENUM_OK;
+    last = 0;
+    count = 0;
+    while ((status == PRIMENUM_OK)
+           && ((n = fread(values, sizeof(primenum_int),
+                          COPY_SIZE, in)) > 0)) {
+        /* Every value must be in range and larger than the one before */
+        for (i = 0; i < n; ++i) {
+            if ((values[i] < shard.from)
+                || (values[i] >= shard.to)
+                || ((count + i > 0) && (values[i] <= last))) {
+                status = PRIMENUM_INVALID;
+                break;
+            }
+            last = values[i];
+        }
+        count += n;
+        if ((status == PRIMENUM_OK)
+            && (fwrite(values, sizeof(primenum_int), n, out) != n))
+            status = PRIMENUM_DISK_FULL;
+    }
+
+    /* Catch files that changed out from under us */
+    if ((status == PRIMENUM_OK)
+        && ((count != shard.count) || (ferror(in))))
+        status = PRIMENUM_INVALID;
+
+    fclose(in);
+    return status;
+}
+
+void
+usage(FILE *stream, char *exe_path)
+{
+    fprintf(stream,
+            "Usage: %s [-h] [-s] -o PATH SHARD [SHARD ...]\n"
+            "  -h       Display this help message and exit\n"
+            "  -o PATH  Write the merged primes to the specified file\n"
+            "  -s       Write a shard file instead of a plain dump\n",
+            exe_path);
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt, status;
+    int i, num_inputs;
+    struct input *inputs;
+    struct primenum_shard merged;
+    const char *out_path;
+    char *tmp_path;
+    bool write_shard;
+    FILE *in, *out;
+
+    out_path = NULL;
+    write_shard = false;
+
+    while ((opt = getopt(argc, argv, "ho:s")) != -1) {
+        switch (opt) {
+            case 'o':
+                out_path = optarg;
+                break;
+            case 's':
+                write_shard = true;
+                break;
+            case 'h': /* display help nicely */
+                usage(stdout, argv[0]);
+                return 0;
+            default: /* '?'; display help passive-aggressively */
+                usage(stderr, argv[0]);
+                return 1;
+        }
+    }
+
+    /* We need an output file and at least one shard */
+    if ((out_path == NULL) || (optind >= argc)) {
+        usage(stderr, argv[0]);
+        return 1;
+    }
+
+    num_inputs = argc - optind;
+    inputs = malloc(num_inputs * sizeof(struct input));
+    if (inputs == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return PRIMENUM_MEM_FULL;
+    }
+
+    /* Read every header up front so we can check the ranges line up
+     * before writing anything */
+    for (i = 0; i < num_inputs; ++i) {
+        inputs[i].path = argv[optind + i];
+        in = fopen(inputs[i].path, "rb");
+        status = (in == NULL)
+                 ? PRIMENUM_INVALID
+                 : primenum_shard_read_header(in, &inputs[i].shard);
+        if (in != NULL)
+            fclose(in);
+        if (status != PRIMENUM_OK) {
+            fprintf(stderr, "%s: Not a valid shard file\n", inputs[i].path);
+            free(inputs);
+            return status;
+        }
+    }
+    qsort(inputs, num_inputs, sizeof(struct input), compare_inputs);
+
+    merged.from = inputs[0].shard.from;
+    merged.to = inputs[0].shard.to;
+    merged.count = inputs[0].shard.count;
+    for (i = 1; i < num_inputs; ++i) {
+        if (inputs[i].shard.from != merged.to) {
+            fprintf(stderr,
+                    "%s: Expected a shard starting at %"PRIMENUM_FMT
+                    ", not %"PRIMENUM_FMT"\n",
+                    inputs[i].path, merged.to, inputs[i].shard.from);
+            free(inputs);
+            return PRIMENUM_INVALID;
+        }
+        merged.to = inputs[i].shard.to;
+        merged.count += inputs[i].shard.count;
+    }
+
+    /* A plain dump is loaded as a complete list of primes, so it can't
+     * have anything missing from the start */
+    if ((!write_shard) && (merged.from > 2)) {
+        fprintf(stderr,
+                "Shards start at %"PRIMENUM_FMT", so a plain dump would be "
+                "incomplete; use -s to write a shard instead\n",
+                merged.from);
+        free(inputs);
+        return PRIMENUM_INVALID;
+    }
+
+    /* Write to a temporary file and only replace the output once we're
+     * done, since the output may well be one of the inputs */
+    tmp_path = malloc(strlen(out_path) + 32);
+    if (tmp_path == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        free(inputs);
+        return PRIMENUM_MEM_FULL;
+    }
+    out = open_temp(out_path, tmp_path);
+    if (out == NULL) {
+        fprintf(stderr, "%s: Cannot open for writing\n", tmp_path);
+        free(tmp_path);
+        free(inputs);
+        return PRIMENUM_DISK_FULL;
+    }
+
+    status = PRIMENUM_OK;
+    if (write_shard)
+        status = primenum_shard_write_header(out, &merged);
+    for (i = 0; (status == PRIMENUM_OK) && (i < num_inputs); ++i) {
+        status = copy_shard(&inputs[i], out);
+        if (status == PRIMENUM_INVALID)
+            fprintf(stderr, "%s: Invalid data encountered\n",
+                    inputs[i].path);
+    }
+    if ((fclose(out) != 0) && (status == PRIMENUM_OK))
+        status = PRIMENUM_DISK_FULL;
+
+    if ((status == PRIMENUM_OK) && (rename(tmp_path, out_path) != 0)) {
+        fprintf(stderr, "%s: Cannot replace with %s\n", out_path, tmp_path);
+        status = PRIMENUM_DISK_FULL;
+    } else if (status == PRIMENUM_DISK_FULL)
+        fprintf(stderr, "Out of disk space\n");
+    if (status != PRIMENUM_OK)
+        remove(tmp_path); /* don't leave a partial file lying around */
+
+    free(tmp_path);
+    free(inputs);
+    return status;
+}
@@ -17,10 +17,66 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <tgmath.h>
 
 #include "primenum.h"
 
+/* Number of values per segment in primenum_mult_range() */
+/* This keeps each segment's working arrays within a typical L2 cache. */
+#define MULT_SEGMENT 8192
+
+/* Marks the end of a chain of primes in struct mult_sieve */
+#define MULT_NONE ((size_t)-1)
+
+/* The base primes for sieving a range in segments */
+/* Each prime's next multiple is carried from one segment to the next, as
+ * in any segmented sieve. Primes smaller than a segment hit every segment
+ * and are checked each time. Larger ones hit a segment at most once, so
+ * they're filed in a circular array of buckets by the segment they hit
+ * next; each segment only visits the primes that actually divide one of
+ * its values, keeping the total work at O(n log log n). */
+struct mult_sieve {
+    primenum_int from;          /* start of the range */
+    primenum_int to;            /* end of the range */
+    primenum_int segment;       /* values per segment */
+    primenum_int *primes;       /* primes up to floor(sqrt(to - 1)) */
+    primenum_int *next;         /* next multiple of each prime, or to */
+    size_t count;               /* number of primes */
+    size_t small;               /* number of primes below segment */
+    size_t *link;               /* next large prime in the same bucket */
+    size_t *buckets;            /* first large prime due in each segment */
+    size_t num_buckets;
+};
+
+/* Prepare to sieve the range [from, to) in segments of the given size */
+/* This returns one of the status codes enumerated in primenum.h. The
+ * list is extended to floor(sqrt(to - 1)) first if necessary. */
+static int mult_sieve_init(struct mult_sieve *sieve,
+                           struct primenum_list *list,
+                           primenum_int from,
+                           primenum_int to,
+                           primenum_int segment);
+
+/* Free the arrays allocated by mult_sieve_init() */
+static void mult_sieve_free(struct mult_sieve *sieve);
+
+/* File a large prime under the segment containing its next multiple */
+static void mult_sieve_file(struct mult_sieve *sieve, size_t j);
+
+/* Compute functions for the segment starting at mult->first */
+/* Segments must be processed in order, and remaining must have room for
+ * mult->count values. */
+static void mult_sieve_segment(struct mult_sieve *sieve,
+                               struct primenum_mult *mult,
+                               primenum_int *remaining);
+
+/* Apply the contribution of prime p to element i of the segment */
+static void mult_apply(struct primenum_mult *mult,
+                       primenum_int *remaining,
+                       primenum_int i,
+                       primenum_int p);
+
 bool
 primenum_stop_never(primenum_int upper_bound,
                     struct primenum_list *list, primenum_int candidate)
@@ -143,6 +199,46 @@ primenum_test_loop(struct primenum_list *list,
     return status;
 }
 
+int
+primenum_test_range(struct primenum_list *list,
+                    primenum_int from,
+                    primenum_int to,
+                    primenum_found_cb found_cb,
+                    void *cb_data)
+{
+    int status;
+    primenum_int root, candidate;
+
+    if (from >= to)
+        return PRIMENUM_OK; /* nothing to do */
+
+    /* Make sure we have all the primes we need for trial division */
+    root = floor(sqrt(to - 1));
+    status = PRIMENUM_OK;
+    if (list->tail->value < root)
+        status = primenum_test_loop(list,
+                                    primenum_stop_at_value, root,
+                                    NULL, NULL);
+    if (status != PRIMENUM_OK)
+        return status;
+
+    /* Two is the only even prime, so get it out of the way first */
+    if ((from <= 2) && (to > 2) && (found_cb != NULL))
+        status = found_cb(2, cb_data);
+
+    /* Start at the first odd value in the range above 2 */
+    candidate = (from < 3) ? 3 : from | 1;
+    while ((status == PRIMENUM_OK) && (candidate < to)) {
+        /* Skip multiples of five the same way primenum_test_loop() does */
+        if (((candidate == 5) || (candidate % 5 != 0))
+            && (primenum_test_inner(list, candidate))
+            && (found_cb != NULL))
+            status = found_cb(candidate, cb_data);
+        candidate += 2;
+    }
+    return status;
+}
+
 struct primenum_list *
 primenum_factors(struct primenum_list *list, primenum_int value,
                  primenum_factor_cb factor_cb, void *cb_data)
@@ -181,6 +277,294 @@ primenum_factors(struct primenum_list *list, primenum_int value,
     return factors;
 }
 
+int
+mult_sieve_init(struct mult_sieve *sieve,
+                struct primenum_list *list,
+                primenum_int from,
+                primenum_int to,
+                primenum_int segment)
+{
+    int status;
+    size_t j;
+    primenum_int root, p, offset;
+    struct primenum_entry *factor;
+
+    sieve->from = from;
+    sieve->to = to;
+    sieve->segment = segment;
+    sieve->primes = NULL;
+    sieve->next = NULL;
+    sieve->link = NULL;
+    sieve->buckets = NULL;
+
+    /* Make sure we have all the primes we need */
+    root = floor(sqrt(to - 1));
+    status = PRIMENUM_OK;
+    if (list->tail->value < root)
+        status = primenum_test_loop(list,
+                                    primenum_stop_at_value, root,
+                                    NULL, NULL);
+    if (status != PRIMENUM_OK)
+        return status;
+
+    /* Copy them into an array, which is much faster to walk */
+    sieve->count = 0;
+    for (factor = list->head;
+         (factor != NULL) && (factor->value <= (to - 1) / factor->value);
+         factor = factor->next)
+        sieve->count++;
+
+    /* A prime's next multiple is never more than p / segment + 1
+     * segments ahead, so this many buckets is enough to go around, with
+     * one to spare in case sqrt() came up short */
+    sieve->num_buckets = root / segment + 3;
+    sieve->primes = malloc((sieve->count + 1) * sizeof(primenum_int));
+    sieve->next = malloc((sieve->count + 1) * sizeof(primenum_int));
+    sieve->link = malloc((sieve->count + 1) * sizeof(size_t));
+    sieve->buckets = malloc(sieve->num_buckets * sizeof(size_t));
+    if ((sieve->primes == NULL)
+        || (sieve->next == NULL)
+        || (sieve->link == NULL)
+        || (sieve->buckets == NULL)) {
+        mult_sieve_free(sieve);
+        return PRIMENUM_MEM_FULL;
+    }
+    for (j = 0; j < sieve->num_buckets; ++j)
+        sieve->buckets[j] = MULT_NONE;
+
+    sieve->small = 0;
+    for (j = 0, factor = list->head;
+         j < sieve->count;
+         ++j, factor = factor->next) {
+        p = factor->value;
+        sieve->primes[j] = p;
+        if (p < segment)
+            sieve->small = j + 1;
+
+        /* Find the first multiple in range, without overflowing */
+        offset = (p - from % p) % p;
+        sieve->next[j] = (offset < to - from) ? from + offset : to;
+        if ((p >= segment) && (sieve->next[j] < to))
+            mult_sieve_file(sieve, j);
+    }
+    return PRIMENUM_OK;
+}
+
+void
+mult_sieve_free(struct mult_sieve *sieve)
+{
+    free(sieve->primes);
+    free(sieve->next);
+    free(sieve->link);
+    free(sieve->buckets);
+}
+
+void
+mult_sieve_file(struct mult_sieve *sieve, size_t j)
+{
+    size_t bucket;
+
+    bucket = ((sieve->next[j] - sieve->from) / sieve->segment)
+             % sieve->num_buckets;
+    sieve->link[j] = sieve->buckets[bucket];
+    sieve->buckets[bucket] = j;
+}
+
+void
+mult_apply(struct primenum_mult *mult, primenum_int *remaining,
+           primenum_int i, primenum_int p)
+{
+    primenum_int v, power, sum;
+    unsigned int exponent;
+
+    /* Find the largest power of p dividing this value */
+    v = remaining[i] / p;
+    exponent = 1;
+    power = p;
+    sum = 1 + p;
+    while (v % p == 0) {
+        v /= p;
+        exponent++;
+        power *= p;
+        sum += power;
+    }
+    remaining[i] = v;
+
+    if (mult->totient != NULL)
+        mult->totient[i] *= power - power / p;
+    if (mult->mobius != NULL)
+        mult->mobius[i] = (exponent > 1) ? 0 : -mult->mobius[i];
+    if (mult->divisors != NULL)
+        mult->divisors[i] *= exponent + 1;
+    if (mult->divisor_sum != NULL)
+        mult->divisor_sum[i] *= sum;
+    if (mult->omega != NULL)
+        mult->omega[i]++;
+}
+
+void
+mult_sieve_segment(struct mult_sieve *sieve,
+                   struct primenum_mult *mult,
+                   primenum_int *remaining)
+{
+    primenum_int i, p, left;
+    size_t j, next_j, bucket;
+
+    /* Start every value at the multiplicative identity. remaining[i] is
+     * what's left of the value once its known factors are divided out. */
+    for (i = 0; i < mult->count; ++i) {
+        remaining[i] = mult->first + i;
+        if (mult->totient != NULL)
+            mult->totient[i] = 1;
+        if (mult->mobius != NULL)
+            mult->mobius[i] = 1;
+        if (mult->divisors != NULL)
+            mult->divisors[i] = 1;
+        if (mult->divisor_sum != NULL)
+            mult->divisor_sum[i] = 1;
+        if (mult->omega != NULL)
+            mult->omega[i] = 0;
+    }
+
+    /* Values left in the range after this segment */
+    left = sieve->to - mult->first - mult->count;
+
+    /* Strike out each small prime's multiples, like the sieve of
+     * Eratosthenes, but apply its contribution to each function as we go */
+    for (j = 0; j < sieve->small; ++j) {
+        p = sieve->primes[j];
+        for (i = sieve->next[j] - mult->first; i < mult->count; i += p)
+            mult_apply(mult, remaining, i, p);
+        sieve->next[j] = (i - mult->count < left)
+                         ? mult->first + i
+                         : sieve->to;
+    }
+
+    /* Large primes hit this segment at most once each */
+    bucket = ((mult->first - sieve->from) / sieve->segment)
+             % sieve->num_buckets;
+    j = sieve->buckets[bucket];
+    sieve->buckets[bucket] = MULT_NONE;
+    while (j != MULT_NONE) {
+        next_j = sieve->link[j];
+        p = sieve->primes[j];
+        mult_apply(mult, remaining, sieve->next[j] - mult->first, p);
+        if (p < sieve->to - sieve->next[j]) {
+            sieve->next[j] += p;
+            mult_sieve_file(sieve, j);
+        }
+        j = next_j;
+    }
+
+    /* Anything left over is a single prime factor above the square root */
+    for (i = 0; i < mult->count; ++i) {
+        p = remaining[i];
+        if (p > 1) {
+            if (mult->totient != NULL)
+                mult->totient[i] *= p - 1;
+            if (mult->mobius != NULL)
+                mult->mobius[i] = -mult->mobius[i];
+            if (mult->divisors != NULL)
+                mult->divisors[i] *= 2;
+            if (mult->divisor_sum != NULL)
+                mult->divisor_sum[i] *= p + 1;
+            if (mult->omega != NULL)
+                mult->omega[i]++;
+        }
+    }
+}
+
+int
+primenum_mult_fill(struct primenum_list *list, struct primenum_mult *mult)
+{
+    int status;
+    primenum_int *remaining;
+    struct mult_sieve sieve;
+
+    if (mult->count == 0)
+        return PRIMENUM_OK; /* nothing to do */
+    else if (mult->first == 0)
+        return PRIMENUM_INVALID;
+
+    remaining = malloc(mult->count * sizeof(primenum_int));
+    if (remaining == NULL)
+        return PRIMENUM_MEM_FULL;
+
+    /* Treat the whole run as a single segment */
+    status = mult_sieve_init(&sieve, list,
+                             mult->first, mult->first + mult->count,
+                             mult->count);
+    if (status == PRIMENUM_OK) {
+        mult_sieve_segment(&sieve, mult, remaining);
+        mult_sieve_free(&sieve);
+    }
+    free(remaining);
+    return status;
+}
+
+int
+primenum_mult_range(struct primenum_list *list,
+                    primenum_int from,
+                    primenum_int to,
+                    int which,
+                    primenum_mult_cb mult_cb,
+                    void *cb_data)
+{
+    int status;
+    primenum_int *remaining;
+    struct primenum_mult mult;
+    struct mult_sieve sieve;
+
+    if (from >= to)
+        return PRIMENUM_OK; /* nothing to do */
+    else if (from == 0)
+        return PRIMENUM_INVALID;
+
+    /* Find all the primes we need up front, rather than once per segment */
+    status = mult_sieve_init(&sieve, list, from, to, MULT_SEGMENT);
+    if (status != PRIMENUM_OK)
+        return status;
+
+    /* Allocate each segment's arrays once and reuse them */
+    remaining = malloc(MULT_SEGMENT * sizeof(primenum_int));
+#define ALLOC_IF(flag, type) \
+        ((which & (flag)) ? malloc(MULT_SEGMENT * sizeof(type)) : NULL)
+    mult.totient = ALLOC_IF(PRIMENUM_TOTIENT, primenum_int);
+    mult.mobius = ALLOC_IF(PRIMENUM_MOBIUS, int8_t);
+    mult.divisors = ALLOC_IF(PRIMENUM_DIVISORS, primenum_int);
+    mult.divisor_sum = ALLOC_IF(PRIMENUM_DIVISOR_SUM, primenum_int);
+    mult.omega = ALLOC_IF(PRIMENUM_OMEGA, uint8_t);
+#undef ALLOC_IF
+
+    if ((remaining == NULL)
+        || ((which & PRIMENUM_TOTIENT) && (mult.totient == NULL))
+        || ((which & PRIMENUM_MOBIUS) && (mult.mobius == NULL))
+        || ((which & PRIMENUM_DIVISORS) && (mult.divisors == NULL))
+        || ((which & PRIMENUM_DIVISOR_SUM) && (mult.divisor_sum == NULL))
+        || ((which & PRIMENUM_OMEGA) && (mult.omega == NULL)))
+        status = PRIMENUM_MEM_FULL;
+
+    mult.first = from;
+    while ((status == PRIMENUM_OK) && (mult.first < to)) {
+        mult.count = to - mult.first;
+        if (mult.count > MULT_SEGMENT)
+            mult.count = MULT_SEGMENT;
+        mult_sieve_segment(&sieve, &mult, remaining);
+        if (mult_cb != NULL)
+            status = mult_cb(&mult, cb_data);
+        mult.first += mult.count;
+    }
+
+    mult_sieve_free(&sieve);
+    free(remaining);
+    free(mult.totient);
+    free(mult.mobius);
+    free(mult.divisors);
+    free(mult.divisor_sum);
+    free(mult.omega);
+    return status;
+}
+
 void
 primenum_load_from_disk(struct primenum_list *list, const char *path)
 {
@@ -199,7 +583,39 @@ primenum_load_from_disk(struct primenum_list *list, const char *path)
                         break;
                 }
             }
+            fclose(log);
         }
-        fclose(log);
     }
 }
+
+int
+primenum_shard_write_header(FILE *file, const struct primenum_shard *shard)
+{
+    primenum_int fields[3];
+
+    fields[0] = shard->from;
+    fields[1] = shard->to;
+    fields[2] = shard->count;
+    if ((fwrite(PRIMENUM_SHARD_MAGIC, 1, 8, file) != 8)
+        || (fwrite(fields, sizeof(primenum_int), 3, file) != 3))
+        return PRIMENUM_DISK_FULL;
+    return PRIMENUM_OK;
+}
+
+int
+primenum_shard_read_header(FILE *file, struct primenum_shard *shard)
+{
+    char magic[8];
+    primenum_int fields[3];
+
+    if ((fread(magic, 1, 8, file) != 8)
+        || (memcmp(magic, PRIMENUM_SHARD_MAGIC, 8) != 0)
+        || (fread(fields, sizeof(primenum_int), 3, file) != 3)
+        || (fields[0] > fields[1]))
+        return PRIMENUM_INVALID;
+
+    shard->from = fields[0];
+    shard->to = fields[1];
+    shard->count = fields[2];
+    return PRIMENUM_OK;
+}
@@ -26,6 +26,7 @@ extern "C" {
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 
 /*
@@ -37,6 +38,10 @@ typedef uint64_t primenum_int;  /* numeric type for all operations */
 
 struct primenum_list;
 struct primenum_entry;
+/* A table of primes that can be shared between threads */
+/* Its contents are private; use the primenum_table_*() functions below. */
+struct primenum_table;
+struct primenum_ctx;
 
 /* A linked list of found primes, with fast append */
 struct primenum_list {
@@ -51,6 +56,50 @@ struct primenum_entry {
     struct primenum_entry *next;
 };
 
+/* Per-thread state for using a shared table */
+/* This holds a read-only snapshot of the table, so a thread only needs to
+ * lock the table when it needs primes the snapshot doesn't yet cover. */
+struct primenum_ctx {
+    struct primenum_table *table;
+    const primenum_int *primes; /* all primes up to limit, in order */
+    size_t count;               /* number of values in primes */
+    primenum_int limit;         /* largest value covered by the snapshot */
+};
+
+/* Magic number identifying a shard file */
+#define PRIMENUM_SHARD_MAGIC "PRIMSHRD"
+
+/* The header at the start of a shard file */
+/* A shard holds the primes in the half-open range [from, to), stored after
+ * the header as an ordered sequence of raw primenum_int values. */
+struct primenum_shard {
+    primenum_int from;  /* smallest value tested */
+    primenum_int to;    /* one past the largest value tested */
+    primenum_int count; /* number of primes in the shard */
+};
+
+/* Values of number-theoretic functions for a run of consecutive integers */
+/* Element i of each array holds the value for first + i. Set an array to
+ * NULL to skip computing that function. */
+struct primenum_mult {
+    primenum_int first;         /* first value in the run */
+    primenum_int count;         /* number of values in the run */
+    primenum_int *totient;      /* Euler's totient, phi(n) */
+    int8_t *mobius;             /* Moebius function, mu(n) */
+    primenum_int *divisors;     /* number of divisors, sigma_0(n) */
+    primenum_int *divisor_sum;  /* sum of divisors, sigma_1(n) */
+    uint8_t *omega;             /* number of distinct prime factors */
+};
+
+/* Flags selecting functions for primenum_mult_range() */
+enum {
+    PRIMENUM_TOTIENT = 1 << 0,
+    PRIMENUM_MOBIUS = 1 << 1,
+    PRIMENUM_DIVISORS = 1 << 2,
+    PRIMENUM_DIVISOR_SUM = 1 << 3,
+    PRIMENUM_OMEGA = 1 << 4
+};
+
 /* Status codes for prime_test() and its ilk */
 enum {
     PRIMENUM_OK,        /* success */
@@ -67,6 +116,13 @@ typedef int (*primenum_found_cb)(primenum_int value, void *data);
 /* Signature for a callback function when a prime factor is found. */
 typedef void (*primenum_factor_cb)(primenum_int value, void *data);
 
+/* Signature for a callback function called with each segment of values
+ * computed by primenum_mult_range(). The arrays are only valid until the
+ * callback returns. This function should return one of the status codes
+ * enumerated above. */
+typedef int (*primenum_mult_cb)(const struct primenum_mult *mult,
+                                void *data);
+
 /* Signature for a callback function to set a stop condition for testing.
  * This function should return true when the condition is reached. */
 typedef bool (*primenum_stop_cb)(primenum_int upper_bound,
@@ -137,12 +193,87 @@ int primenum_test_loop(struct primenum_list *list,
                        primenum_found_cb found_cb,
                        void *cb_data);
 
+/* Test every value in the half-open range [from, to) */
+/* This returns one of the status codes enumerated above. Unlike
+ * primenum_test_loop(), found primes are passed to found_cb but not added
+ * to the list, so only primes up to floor(sqrt(to - 1)) are needed. The
+ * list is extended to that point first if necessary. */
+int primenum_test_range(struct primenum_list *list,
+                        primenum_int from,
+                        primenum_int to,
+                        primenum_found_cb found_cb,
+                        void *cb_data);
+
 /* Return a list containing the prime factors of the specified value */
 struct primenum_list *primenum_factors(struct primenum_list *list,
                                        primenum_int value,
                                        primenum_factor_cb factor_cb,
                                        void *cb_data);
 
+/* Compute number-theoretic functions for mult->count values from
+ * mult->first */
+/* This returns one of the status codes enumerated above. Rather than
+ * factoring each value separately, it sieves the whole run at once with
+ * primes up to the square root of its last value, extending the list to
+ * that point first if necessary. Zero is not a valid first value. */
+int primenum_mult_fill(struct primenum_list *list,
+                       struct primenum_mult *mult);
+
+/* Compute the functions selected by which for the range [from, to) */
+/* This returns one of the status codes enumerated above. The range is
+ * split into cache-sized segments that are passed to mult_cb one at a
+ * time, so memory use does not grow with the size of the range. Besides
+ * finding the primes up to floor(sqrt(to - 1)), this takes
+ * O((to - from) log log to) time, however large the values are. */
+int primenum_mult_range(struct primenum_list *list,
+                        primenum_int from,
+                        primenum_int to,
+                        int which,
+                        primenum_mult_cb mult_cb,
+                        void *cb_data);
+
+/* Start a new shared table */
+/* The table is seeded with the contents of list, which is copied and can
+ * be freed afterward. If list is NULL, the table is seeded with the
+ * single-digit primes. */
+struct primenum_table *primenum_table_new(const struct primenum_list *list);
+
+/* Make sure the table contains every prime up to limit */
+/* This returns one of the status codes enumerated above. It is safe to
+ * call from multiple threads; contexts do so automatically as needed. */
+int primenum_table_extend(struct primenum_table *table,
+                          primenum_int limit);
+
+/* Delete the table */
+/* Free every context using the table first. */
+void primenum_table_free(struct primenum_table *table);
+
+/* Start a new context for one thread's use of a shared table */
+/* Each thread needs its own context, but any number of contexts can use
+ * the same table at once. */
+struct primenum_ctx *primenum_ctx_new(struct primenum_table *table);
+
+/* Delete a context */
+void primenum_ctx_free(struct primenum_ctx *ctx);
+
+/* Set *prime to whether a given value is prime */
+/* This returns one of the status codes enumerated above. Unlike
+ * primenum_test(), it extends the shared table as needed rather than
+ * requiring the caller to do so. */
+int primenum_ctx_test(struct primenum_ctx *ctx,
+                      primenum_int value,
+                      bool *prime);
+
+/* Return a list containing the prime factors of the specified value */
+/* Unlike primenum_factors(), this only needs primes up to the square root
+ * of what's left once smaller factors are divided out, and leaves the
+ * shared table unchanged if it already has them. The factor callback
+ * receives each factor as it is found. */
+struct primenum_list *primenum_ctx_factors(struct primenum_ctx *ctx,
+                                           primenum_int value,
+                                           primenum_factor_cb factor_cb,
+                                           void *cb_data);
+
 /* Load previously found primes from disk */
 /* The file format is an ordered sequence of raw primenum_int values.
  * This can be a convenient time saver, but beware there is no guarantee
@@ -151,6 +282,17 @@ struct primenum_list *primenum_factors(struct primenum_list *list,
 void primenum_load_from_disk(struct primenum_list *list,
                              const char *path);
 
+/* Write a shard header at the current position in the file */
+/* This returns PRIMENUM_OK or PRIMENUM_DISK_FULL. */
+int primenum_shard_write_header(FILE *file,
+                                const struct primenum_shard *shard);
+
+/* Read a shard header from the current position in the file */
+/* This returns PRIMENUM_OK, or PRIMENUM_INVALID if the file does not
+ * start with a valid shard header. */
+int primenum_shard_read_header(FILE *file,
+                               struct primenum_shard *shard);
+
 
 #ifdef __cplusplus
 } /* extern "C" */
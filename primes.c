@@ -15,88 +15,356 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "primenum.h"
 
+/* Default memory budget for buffered dump output, in kilobytes */
+#define LOG_BUFFER_KB 1024
+
+/* A dump file written to disk by a background thread */
+/* Found primes are collected in one buffer while the other is being
+ * written, so sieving only waits on the disk when both buffers are full.
+ * This caps the memory used for pending output at the two buffers. */
+struct log {
+    FILE *file;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       /* signaled when a buffer needs writing */
+    pthread_cond_t done;        /* signaled when a buffer has been written */
+    primenum_int *buffers[2];
+    size_t capacity;            /* values per buffer */
+    size_t fill;                /* values in the buffer being filled */
+    size_t pending;             /* values in the buffer being written */
+    int active;                 /* index of the buffer being filled */
+    bool closing;               /* no more values will be added */
+    bool failed;                /* a write came up short */
+    uint64_t bytes;             /* total bytes written */
+    double seconds;             /* total time spent writing */
+};
+
 /* Start a new log */
-/* Set path to NULL to print output to the screen only. */
-static FILE *log_start(struct primenum_list *list,
-                       const char *path);
+/* This returns one of the status codes enumerated in primenum.h, and on
+ * success sets *log to the new log. Set path to NULL to print output to
+ * the screen only, in which case *log is set to NULL. The log buffers
+ * up to buffer_kb kilobytes of values before the sieve has to wait.
+ * If shard is not NULL, the log is written as a shard file whose header
+ * describes an empty range until it is completed by log_close(). */
+static int log_start(struct log **log,
+                     struct primenum_list *list,
+                     const char *path,
+                     size_t buffer_kb,
+                     const struct primenum_shard *shard);
 
 /* Write a value to the log and display it on screen */
 static int log_write(primenum_int value, void *log);
 
-/* Close the log */
-static void log_close(FILE *log);
+/* Hand the active buffer to the writer thread */
+static int log_flush(struct log *log);
+
+/* Write buffers to disk as they fill up */
+static void *log_thread(void *log);
+
+/* Close the log and report write throughput */
+/* If shard is not NULL, the shard header is rewritten to cover its range
+ * and the number of values logged. This returns PRIMENUM_DISK_FULL if any
+ * buffered values were lost. */
+static int log_close(struct log *log,
+                     const struct primenum_shard *shard);
+
+/* Return the current time in seconds */
+static double now(void);
+
+/* Stop testing when interrupted, or when the real stop condition says so */
+static bool stop_or_interrupt(primenum_int upper_bound,
+                              struct primenum_list *list,
+                              primenum_int candidate);
+
+/* Note that we've been interrupted */
+static void on_interrupt(int signum);
 
 /* Display usage instructions */
 static void usage(FILE *stream, char *exe_path);
 
+/* The stop condition wrapped by stop_or_interrupt() */
+static primenum_stop_cb real_stop_cb;
+
+/* Set when SIGINT is received */
+static volatile sig_atomic_t interrupted;
 
-FILE *
-log_start(struct primenum_list *list, const char *path)
+
+int
+log_start(struct log **logp, struct primenum_list *list, const char *path,
+          size_t buffer_kb, const struct primenum_shard *shard)
 {
-    FILE *log;
+    int status;
+    struct log *log;
     struct primenum_entry *curr;
+    struct primenum_shard placeholder;
+    sigset_t block, saved;
 
+    *logp = NULL;
     if (path == NULL)
-        log = NULL;
-    else
-        log = fopen(path, "wb");
+        return PRIMENUM_OK;
+
+    log = malloc(sizeof(struct log));
+    if (log == NULL)
+        return PRIMENUM_MEM_FULL;
+
+    log->capacity = buffer_kb * 1024 / 2 / sizeof(primenum_int);
+    if (log->capacity == 0)
+        log->capacity = 1;
+    log->fill = 0;
+    log->pending = 0;
+    log->active = 0;
+    log->closing = false;
+    log->failed = false;
+    log->bytes = 0;
+    log->seconds = 0;
+
+    log->buffers[0] = malloc(log->capacity * sizeof(primenum_int));
+    log->buffers[1] = malloc(log->capacity * sizeof(primenum_int));
+    if ((log->buffers[0] == NULL) || (log->buffers[1] == NULL)) {
+        free(log->buffers[0]);
+        free(log->buffers[1]);
+        free(log);
+        return PRIMENUM_MEM_FULL;
+    }
+
+    log->file = fopen(path, "wb");
+    if (log->file == NULL) {
+        free(log->buffers[0]);
+        free(log->buffers[1]);
+        free(log);
+        return PRIMENUM_DISK_FULL;
+    }
+    /* We do our own buffering, so let short writes show up right away */
+    setvbuf(log->file, NULL, _IONBF, 0);
+
+    if (shard != NULL) {
+        /* Don't claim to cover the range until we've finished it */
+        placeholder.from = shard->from;
+        placeholder.to = shard->from;
+        placeholder.count = 0;
+        if (primenum_shard_write_header(log->file,
+                                        &placeholder) != PRIMENUM_OK) {
+            fclose(log->file);
+            free(log->buffers[0]);
+            free(log->buffers[1]);
+            free(log);
+            return PRIMENUM_DISK_FULL;
+        }
+    }
+
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->ready, NULL);
+    pthread_cond_init(&log->done, NULL);
+
+    /* Leave SIGINT to the sieving thread so it can shut down cleanly */
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &block, &saved);
+    if (pthread_create(&log->thread, NULL, log_thread, log) != 0) {
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        pthread_cond_destroy(&log->done);
+        pthread_cond_destroy(&log->ready);
+        pthread_mutex_destroy(&log->lock);
+        fclose(log->file);
+        free(log->buffers[0]);
+        free(log->buffers[1]);
+        free(log);
+        return PRIMENUM_MEM_FULL; /* couldn't get a thread */
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
 
     if (list != NULL) {
         /* Log existing entries in the list */
         for (curr = list->head;
              curr != NULL;
              curr = curr->next) {
-            if (log_write(curr->value, log) != PRIMENUM_OK) {
-                log_close(log);
-                log = NULL;
-                break;
+            status = log_write(curr->value, log);
+            if (status != PRIMENUM_OK) {
+                log_close(log, NULL);
+                return status;
             }
         }
     }
-    return log;
+    *logp = log;
+    return PRIMENUM_OK;
 }
 
 int
-log_write(primenum_int value, void *log)
+log_write(primenum_int value, void *data)
 {
-    bool status;
+    int status;
+    struct log *log;
 
-    if (log == NULL)
-        status = PRIMENUM_OK; /* so we can print it on screen */
-    else if (fwrite(&value, sizeof(primenum_int), 1, log) == 1)
-        status = PRIMENUM_OK; /* successfully written  to disk */
-    else
-        status = PRIMENUM_DISK_FULL;
+    log = data;
+    status = PRIMENUM_OK; /* until proven otherwise */
+    if (log != NULL) {
+        log->buffers[log->active][log->fill++] = value;
+        if (log->fill == log->capacity)
+            status = log_flush(log);
+    }
 
     if (status == PRIMENUM_OK)
         printf("%"PRIMENUM_FMT"\n", value);
     return status;
 }
 
+int
+log_flush(struct log *log)
+{
+    int status;
+
+    pthread_mutex_lock(&log->lock);
+    /* Wait for the writer to finish with the other buffer */
+    while ((log->pending != 0) && (!log->failed))
+        pthread_cond_wait(&log->done, &log->lock);
+
+    if (log->failed)
+        status = PRIMENUM_DISK_FULL;
+    else {
+        status = PRIMENUM_OK;
+        if (log->fill != 0) {
+            /* Swap buffers and let the writer have the full one */
+            log->pending = log->fill;
+            log->active = !log->active;
+            log->fill = 0;
+            pthread_cond_signal(&log->ready);
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    return status;
+}
+
+void *
+log_thread(void *data)
+{
+    struct log *log;
+    primenum_int *buffer;
+    size_t count, written;
+    double start, end;
+
+    log = data;
+    pthread_mutex_lock(&log->lock);
+    for (;;) {
+        while ((log->pending == 0) && (!log->closing))
+            pthread_cond_wait(&log->ready, &log->lock);
+        if (log->pending == 0)
+            break; /* closing, and nothing left to write */
+
+        buffer = log->buffers[!log->active];
+        count = log->pending;
+
+        /* Write without holding the lock so sieving can continue */
+        pthread_mutex_unlock(&log->lock);
+        start = now();
+        written = fwrite(buffer, sizeof(primenum_int), count, log->file);
+        end = now();
+        pthread_mutex_lock(&log->lock);
+
+        log->bytes += written * sizeof(primenum_int);
+        log->seconds += end - start;
+        if (written != count)
+            log->failed = true;
+        log->pending = 0;
+        pthread_cond_signal(&log->done);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+int
+log_close(struct log *log, const struct primenum_shard *shard)
+{
+    int status;
+    struct primenum_shard header;
+
+    if (log == NULL)
+        return PRIMENUM_OK;
+
+    /* Write out whatever's left in the active buffer */
+    status = log_flush(log);
+
+    pthread_mutex_lock(&log->lock);
+    log->closing = true;
+    pthread_cond_signal(&log->ready);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->thread, NULL);
+
+    if ((shard != NULL) && (!log->failed) && (status == PRIMENUM_OK)) {
+        header = *shard;
+        header.count = log->bytes / sizeof(primenum_int);
+        if ((fseek(log->file, 0, SEEK_SET) != 0)
+            || (primenum_shard_write_header(log->file,
+                                            &header) != PRIMENUM_OK))
+            status = PRIMENUM_DISK_FULL;
+    }
+
+    if ((log->failed) || (fclose(log->file) != 0))
+        status = PRIMENUM_DISK_FULL;
+    else if (log->seconds > 0)
+        fprintf(stderr, "Wrote %"PRIu64" bytes in %.3f s (%.1f MB/s)\n",
+                log->bytes, log->seconds,
+                log->bytes / log->seconds / 1e6);
+    if (log->failed)
+        fclose(log->file);
+
+    pthread_cond_destroy(&log->done);
+    pthread_cond_destroy(&log->ready);
+    pthread_mutex_destroy(&log->lock);
+    free(log->buffers[0]);
+    free(log->buffers[1]);
+    free(log);
+    return status;
+}
+
+double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool
+stop_or_interrupt(primenum_int upper_bound,
+                  struct primenum_list *list, primenum_int candidate)
+{
+    return (interrupted || real_stop_cb(upper_bound, list, candidate));
+}
+
 void
-log_close(FILE *log)
+on_interrupt(int signum)
 {
-    if (log != NULL)
-        fclose(log);
+    (void)signum;
+    interrupted = 1;
 }
 
 void
 usage(FILE *stream, char *exe_path)
 {
     fprintf(stream,
-            "Usage: %s [-h] [-d PATH] [-l PATH] [-m MAX] [-n NUM]\n"
+            "Usage: %s [-h] [-b KB] [-d PATH] [-l PATH] [-m MAX] [-n NUM]\n"
+            "       %s [-h] [-b KB] [-d PATH] [-l PATH] [-f FROM] -t TO\n"
             "  -h       Display this help message and exit\n"
-            "  -d PATH  Dump found primes to the specified file (implies -l)\n"
+            "  -b KB    Buffer up to KB kilobytes of dump output in memory\n"
+            "  -d PATH  Dump found primes to the specified file (implies -l\n"
+            "           unless -t is given)\n"
+            "  -f FROM  Start testing at the specified value (requires -t)\n"
             "  -l PATH  Load previously found primes from the specified file\n"
             "  -m MAX   Stop after reaching the specified maximum value\n"
-            "  -n NUM   Stop after finding the specified number of primes\n",
-            exe_path);
+            "  -n NUM   Stop after finding the specified number of primes\n"
+            "  -t TO    Test only values below the specified value, dumping\n"
+            "           a shard file for use with pmerge\n",
+            exe_path, exe_path);
 }
 
 int
@@ -106,19 +374,45 @@ main(int argc, char **argv)
     struct primenum_list *list;
     primenum_stop_cb stop_cb;
     primenum_int upper_bound;
+    struct primenum_shard shard;
+    bool use_range;
     const char *log_path;
-    FILE *log;
+    long kb;
+    size_t buffer_kb;
+    struct log *log;
+    struct sigaction action;
 
     list = primenum_list_new(true);
     stop_cb = primenum_stop_never; /* unless overridden */
     upper_bound = 0;
+    shard.from = 0;
+    shard.to = 0;
+    shard.count = 0;
+    use_range = false;
     log_path = NULL;
+    buffer_kb = LOG_BUFFER_KB;
 
-    while ((opt = getopt(argc, argv, "hd:l:m:n:")) != -1) {
+    while ((opt = getopt(argc, argv, "hb:d:f:l:m:n:t:")) != -1) {
         switch (opt) {
+            case 'b':
+                kb = atol(optarg);
+                if ((kb <= 0) || ((unsigned long)kb > SIZE_MAX / 1024)) {
+                    usage(stderr, argv[0]);
+                    return 1;
+                }
+                buffer_kb = kb;
+                break;
             case 'd':
+                /* loaded below unless we're testing a range */
                 log_path = optarg;
-                /* falls through to case 'l' */
+                break;
+            case 'f':
+                shard.from = atol(optarg);
+                break;
+            case 't':
+                shard.to = atol(optarg);
+                use_range = true;
+                break;
             case 'l':
                 primenum_load_from_disk(list, optarg);
                 break;
@@ -140,19 +434,49 @@ main(int argc, char **argv)
         }
     }
 
-    if (optind < argc) {
-        /* don't accept gratuitous command-line arguments */
+    if ((optind < argc)
+        || ((shard.from != 0) && (!use_range))
+        || ((use_range) && (stop_cb != primenum_stop_never))
+        || ((use_range) && (shard.from > shard.to))) {
+        /* don't accept gratuitous or contradictory arguments */
         usage(stderr, argv[0]);
         return 1;
     }
 
-    log = log_start(list, log_path);
-    if ((log_path != NULL) && (log == NULL))
-        status = PRIMENUM_DISK_FULL; /* already? */
-    else
-        status = primenum_test_loop(list,
-                                    stop_cb, upper_bound,
-                                    log_write, log);
+    if (use_range) {
+        /* A shard contains only its own range, and a partial shard is
+         * useless, so there's no point in catching ^C */
+        status = log_start(&log, NULL, log_path, buffer_kb, &shard);
+        if (status == PRIMENUM_OK)
+            status = primenum_test_range(list,
+                                         shard.from, shard.to,
+                                         log_write, log);
+    } else {
+        /* Pick up where the previous dump left off */
+        if (log_path != NULL)
+            primenum_load_from_disk(list, log_path);
+
+        /* Stop cleanly on ^C so buffered output still makes it to disk */
+        /* Use sigaction() rather than signal(), which under strict C99
+         * gives us a one-shot handler that interrupts stdout writes */
+        real_stop_cb = stop_cb;
+        action.sa_handler = on_interrupt;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGINT, &action, NULL);
+
+        status = log_start(&log, list, log_path, buffer_kb, NULL);
+        if (status == PRIMENUM_OK)
+            status = primenum_test_loop(list,
+                                        stop_or_interrupt, upper_bound,
+                                        log_write, log);
+    }
+
+    /* Anything lost while flushing the log counts as running out of disk */
+    if ((log_close(log, ((use_range) && (status == PRIMENUM_OK))
+                        ? &shard : NULL) != PRIMENUM_OK)
+        && ((status == PRIMENUM_OK) || (status == PRIMENUM_OVERFLOW)))
+        status = PRIMENUM_DISK_FULL;
 
     /* If an error occurred, indicate what happened */
     switch (status) {
@@ -171,7 +495,6 @@ main(int argc, char **argv)
             break;
     }
 
-    log_close(log);
     primenum_list_free(list);
     return status;
 }
@@ -0,0 +1,346 @@
+/*
+ * A table of primes shared between threads.
+ * Copyright (c) 2022 Benjamin Johnson <bmjcode@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tgmath.h>
+
+#include "primenum.h"
+
+/* An array that has been replaced by a larger copy */
+struct retired {
+    primenum_int *primes;
+    struct retired *next;
+};
+
+/* The table itself */
+/* Values already published in primes[] never change, and arrays that are
+ * outgrown are kept until the table is freed instead of being reallocated.
+ * That way a context can keep reading its snapshot without any locking
+ * while another thread extends the table. */
+struct primenum_table {
+    pthread_mutex_t lock;       /* held while extending the table */
+    primenum_int *primes;       /* all primes up to limit, in order */
+    size_t count;               /* number of values in primes */
+    size_t capacity;            /* number of values primes has room for */
+    primenum_int limit;         /* largest value tested so far */
+    struct retired *retired;    /* arrays still visible to old snapshots */
+};
+
+/* Return floor(sqrt(value)), without floating-point rounding errors */
+static primenum_int int_sqrt(primenum_int value);
+
+/* Add a value to the table, growing it if necessary */
+/* This must be called with the lock held. */
+static int table_add(struct primenum_table *table, primenum_int value);
+
+/* Make sure the context's snapshot covers values up to limit */
+static int ctx_require(struct primenum_ctx *ctx, primenum_int limit);
+
+/* Order values for bsearch() */
+static int compare_values(const void *a, const void *b);
+
+
+primenum_int
+int_sqrt(primenum_int value)
+{
+    primenum_int root;
+
+    root = floor(sqrt(value));
+    /* Correct for sqrt() being off by one on very large values */
+    while ((root > 0) && (root > value / root))
+        root--;
+    while ((root + 1) <= value / (root + 1))
+        root++;
+    return root;
+}
+
+int
+table_add(struct primenum_table *table, primenum_int value)
+{
+    primenum_int *primes;
+    struct retired *retired;
+
+    if (table->count == table->capacity) {
+        /* Copy into a bigger array rather than using realloc(), since
+         * other threads may still be reading the old one */
+        primes = malloc(2 * table->capacity * sizeof(primenum_int));
+        retired = malloc(sizeof(struct retired));
+        if ((primes == NULL) || (retired == NULL)) {
+            free(primes);
+            free(retired);
+            return PRIMENUM_MEM_FULL;
+        }
+        memcpy(primes, table->primes, table->count * sizeof(primenum_int));
+
+        retired->primes = table->primes;
+        retired->next = table->retired;
+        table->retired = retired;
+        table->primes = primes;
+        table->capacity *= 2;
+    }
+    table->primes[table->count++] = value;
+    return PRIMENUM_OK;
+}
+
+struct primenum_table *
+primenum_table_new(const struct primenum_list *list)
+{
+    struct primenum_table *table;
+    struct primenum_entry *curr;
+
+    table = malloc(sizeof(struct primenum_table));
+    if (table == NULL)
+        return NULL;
+
+    table->count = 0;
+    table->capacity = 1024;
+    table->limit = 0;
+    table->retired = NULL;
+    table->primes = malloc(table->capacity * sizeof(primenum_int));
+    if (table->primes == NULL) {
+        free(table);
+        return NULL;
+    }
+
+    pthread_mutex_init(&table->lock, NULL);
+    if ((list == NULL) || (list->head == NULL)) {
+        /* Seed the table with the single-digit primes */
+        table->primes[table->count++] = 2;
+        table->primes[table->count++] = 3;
+        table->primes[table->count++] = 5;
+        table->primes[table->count++] = 7;
+        table->limit = 7;
+    } else {
+        for (curr = list->head;
+             curr != NULL;
+             curr = curr->next) {
+            if (table_add(table, curr->value) != PRIMENUM_OK) {
+                primenum_table_free(table);
+                return NULL;
+            }
+            table->limit = curr->value;
+        }
+    }
+    return table;
+}
+
+int
+primenum_table_extend(struct primenum_table *table, primenum_int limit)
+{
+    int status;
+    bool prime;
+    size_t i;
+    primenum_int candidate, root;
+
+    pthread_mutex_lock(&table->lock);
+    status = PRIMENUM_OK;
+    if (table->limit < limit) {
+        /* The table only ever holds odd values past 2, so continue from
+         * the next odd value after the last one tested */
+        candidate = table->limit + 1 + (table->limit % 2);
+        while ((status == PRIMENUM_OK) && (candidate <= limit)) {
+            /* Trial division against the table, as in
+             * primenum_test_inner() */
+            prime = true;
+            root = int_sqrt(candidate);
+            for (i = 0;
+                 (prime) && (i < table->count)
+                 && (table->primes[i] <= root);
+                 ++i) {
+                if (candidate % table->primes[i] == 0)
+                    prime = false;
+            }
+            if (prime)
+                status = table_add(table, candidate);
+            if (status == PRIMENUM_OK)
+                table->limit = candidate;
+
+            if (limit - candidate < 2)
+                break; /* don't overflow */
+            candidate += 2;
+        }
+        if ((status == PRIMENUM_OK) && (table->limit < limit))
+            table->limit = limit; /* limit was even */
+    }
+    pthread_mutex_unlock(&table->lock);
+    return status;
+}
+
+void
+primenum_table_free(struct primenum_table *table)
+{
+    struct retired *curr, *next;
+
+    curr = table->retired;
+    while (curr != NULL) {
+        next = curr->next;
+        free(curr->primes);
+        free(curr);
+        curr = next;
+    }
+    pthread_mutex_destroy(&table->lock);
+    free(table->primes);
+    free(table);
+}
+
+struct primenum_ctx *
+primenum_ctx_new(struct primenum_table *table)
+{
+    struct primenum_ctx *ctx;
+
+    ctx = malloc(sizeof(struct primenum_ctx));
+    if (ctx != NULL) {
+        ctx->table = table;
+        ctx->primes = NULL;
+        ctx->count = 0;
+        ctx->limit = 0;
+    }
+    return ctx;
+}
+
+void
+primenum_ctx_free(struct primenum_ctx *ctx)
+{
+    free(ctx);
+}
+
+int
+ctx_require(struct primenum_ctx *ctx, primenum_int limit)
+{
+    int status;
+    struct primenum_table *table;
+
+    /* This is the common case, and needs no locking at all */
+    if (ctx->limit >= limit)
+        return PRIMENUM_OK;
+
+    table = ctx->table;
+    status = primenum_table_extend(table, limit);
+    if (status == PRIMENUM_OK) {
+        /* Take a fresh snapshot */
+        pthread_mutex_lock(&table->lock);
+        ctx->primes = table->primes;
+        ctx->count = table->count;
+        ctx->limit = table->limit;
+        pthread_mutex_unlock(&table->lock);
+    }
+    return status;
+}
+
+int
+compare_values(const void *a, const void *b)
+{
+    const primenum_int *x = a, *y = b;
+
+    return (*x < *y) ? -1 : (*x > *y);
+}
+
+int
+primenum_ctx_test(struct primenum_ctx *ctx, primenum_int value, bool *prime)
+{
+    int status;
+    size_t i;
+    primenum_int root;
+
+    if (value < 2) {
+        *prime = false;
+        return PRIMENUM_OK;
+    }
+
+    root = int_sqrt(value);
+    status = ctx_require(ctx, root);
+    if (status != PRIMENUM_OK)
+        return status;
+
+    if (value <= ctx->limit) {
+        /* We already know the answer */
+        *prime = (bsearch(&value, ctx->primes, ctx->count,
+                          sizeof(primenum_int), compare_values) != NULL);
+        return PRIMENUM_OK;
+    }
+
+    *prime = true;
+    for (i = 0;
+         (*prime) && (i < ctx->count) && (ctx->primes[i] <= root);
+         ++i) {
+        if (value % ctx->primes[i] == 0)
+            *prime = false;
+    }
+    return PRIMENUM_OK;
+}
+
+struct primenum_list *
+primenum_ctx_factors(struct primenum_ctx *ctx, primenum_int value,
+                     primenum_factor_cb factor_cb, void *cb_data)
+{
+    size_t i;
+    primenum_int p, root, limit;
+    struct primenum_list *factors;
+
+    factors = primenum_list_new(false);
+    if (factors == NULL)
+        return NULL;
+
+    /* Zero and one have no prime factors */
+    if (value < 2)
+        return factors;
+
+#define ADD_FACTOR(p) \
+        do { \
+            if (primenum_list_add(factors, (p)) == NULL) { \
+                primenum_list_free(factors); \
+                return NULL; \
+            } \
+            if (factor_cb != NULL) \
+                factor_cb((p), cb_data); \
+        } while (0)
+    /* We only need to search up to the square root of what's left, since
+     * anything remaining after that must itself be prime */
+    i = 0;
+    while (value > 1) {
+        if (i == ctx->count) {
+            /* We've run out of primes; get more only if we need them,
+             * and only as many as we need, since dividing out small
+             * factors often brings the square root way down */
+            root = int_sqrt(value);
+            if (ctx->limit >= root)
+                break;
+            limit = (ctx->limit < 512) ? 1024 : 2 * ctx->limit;
+            if (ctx_require(ctx, (limit < root) ? limit : root)
+                != PRIMENUM_OK) {
+                primenum_list_free(factors);
+                return NULL;
+            }
+            continue;
+        }
+
+        p = ctx->primes[i++];
+        if (p > value / p)
+            break;
+        while (value % p == 0) {
+            ADD_FACTOR(p);
+            value /= p;
+        }
+    }
+    if (value > 1)
+        ADD_FACTOR(value);
+#undef ADD_FACTOR
+
+    return factors;
+}